@@ -0,0 +1,217 @@
+// Instruction emulators shared by the DLL's trap handler and the Linux
+// fault replay tool. Nothing here may depend on Windows headers: handlers
+// are templates over any context type with the x86 CONTEXT register names.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Target problematic instructions
+constexpr uint16_t ARPL_OPCODE = 0xD063;
+constexpr uint16_t FCOMP_OPCODE = 0xD8DC;
+constexpr uint16_t FCOMP_ST0_OPCODE = 0xD8D8;
+constexpr uint16_t NOP_2BYTES = 0x9090;
+
+// For ZF flag
+constexpr uint32_t ZF_FLAG = 0x40;
+constexpr uint32_t RPL_MASK = 0x3;
+
+// Longest possible x86 instruction
+constexpr int MAX_INSTRUCTION_BYTES = 15;
+
+// Longest replacement a PATCH_REWRITE handler may supply
+constexpr int MAX_PATCH_BYTES = 4;
+
+// Outcome of emulating one faulting instruction
+enum SitePatch {
+    PATCH_NONE,     // Leave the site alone, it will trap again
+    PATCH_STUB,     // Instruction was emulated, the site may be NOPed out
+    PATCH_REWRITE   // Site must be rewritten to `bytes` and re-executed
+};
+
+// Statistic bumped when a site is patched
+enum FixStat {
+    FIX_NONE,
+    FIX_ARPL,
+    FIX_FCOMP
+};
+
+struct EmulateResult {
+    bool handled;
+    SitePatch patch;
+    uint8_t length;                  // Instruction length, bytes covered by a patch
+    uint8_t bytes[MAX_PATCH_BYTES];  // Replacement for PATCH_REWRITE, at most MAX_PATCH_BYTES
+    FixStat stat;
+};
+
+// Decodes the instruction at `code`, updates the context and EIP. Only
+// `length` bytes (at least 1) are readable; a handler that needs more
+// must return NOT_HANDLED.
+template <class Context>
+using EmulateFn = EmulateResult (*)(Context* ctx, const uint8_t* code, size_t length);
+
+constexpr EmulateResult NOT_HANDLED = {false, PATCH_NONE, 0, {0}, FIX_NONE};
+
+// ModRM register operand to context slot
+template <class Context>
+auto ContextRegister(Context* ctx, int reg) -> decltype(&ctx->Eax) {
+    switch (reg & 7) {
+        case 0: return &ctx->Eax;
+        case 1: return &ctx->Ecx;
+        case 2: return &ctx->Edx;
+        case 3: return &ctx->Ebx;
+        case 4: return &ctx->Esp;
+        case 5: return &ctx->Ebp;
+        case 6: return &ctx->Esi;
+        default: return &ctx->Edi;
+    }
+}
+
+// Emulator registry, keyed by the first opcode byte. Registering an
+// instruction means specializing Emulator<> and returning its handler.
+template <int Opcode>
+struct Emulator {
+    template <class Context>
+    static constexpr EmulateFn<Context> handler() { return nullptr; }
+};
+
+// ARPL r/m16, r16 (63 /r), register form only
+template <>
+struct Emulator<0x63> {
+    template <class Context>
+    static EmulateResult Emulate(Context* ctx, const uint8_t* code, size_t length) {
+        if (length < 2) {
+            return NOT_HANDLED;
+        }
+
+        uint8_t modrm = code[1];
+        if ((modrm >> 6) != 3) {
+            return NOT_HANDLED;
+        }
+
+        auto dest = ContextRegister(ctx, modrm);
+        auto src = ContextRegister(ctx, modrm >> 3);
+
+        uint16_t destVal = static_cast<uint16_t>(*dest);
+        uint16_t srcVal = static_cast<uint16_t>(*src);
+
+        if ((destVal & RPL_MASK) < (srcVal & RPL_MASK)) {
+            // Set ZF
+            ctx->EFlags |= ZF_FLAG;
+
+            // Update destination
+            destVal = (destVal & ~RPL_MASK) | (srcVal & RPL_MASK);
+            *dest = (*dest & 0xFFFF0000) | destVal;
+        } else {
+            // Clear ZF
+            ctx->EFlags &= ~ZF_FLAG;
+        }
+
+        // Skip the instruction
+        ctx->Eip += 2;
+
+        // NOPing drops ARPL's data-dependent effect, so only the known
+        // ARPL AX, DX site is stubbed; other forms are emulated every trap
+        bool stub = (code[0] | (code[1] << 8)) == ARPL_OPCODE;
+        EmulateResult result = {true, stub ? PATCH_STUB : PATCH_NONE, 2, {0}, FIX_ARPL};
+        return result;
+    }
+
+    template <class Context>
+    static constexpr EmulateFn<Context> handler() { return Emulate<Context>; }
+};
+
+// FCOMP ST(0) alias encoding (DC D8), rewritten to the canonical D8 D8
+template <>
+struct Emulator<0xDC> {
+    template <class Context>
+    static EmulateResult Emulate(Context*, const uint8_t* code, size_t length) {
+        if (length < 2 || code[1] != (FCOMP_OPCODE >> 8)) {
+            return NOT_HANDLED;
+        }
+
+        // EIP stays put, the rewritten instruction runs on resume
+        EmulateResult result = {true, PATCH_REWRITE, 2,
+                                {FCOMP_ST0_OPCODE & 0xFF, FCOMP_ST0_OPCODE >> 8},
+                                FIX_FCOMP};
+        return result;
+    }
+
+    template <class Context>
+    static constexpr EmulateFn<Context> handler() { return Emulate<Context>; }
+};
+
+// Compile-time expansion of the registry into a flat dispatch table
+template <int... I>
+struct IndexList {};
+
+template <int N, int... I>
+struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+
+template <int... I>
+struct MakeIndexList<0, I...> {
+    typedef IndexList<I...> type;
+};
+
+template <class Context>
+struct EmulatorTable {
+    EmulateFn<Context> entries[256];
+};
+
+template <class Context, int... I>
+constexpr EmulatorTable<Context> MakeEmulatorTable(IndexList<I...>) {
+    return EmulatorTable<Context>{{Emulator<I>::template handler<Context>()...}};
+}
+
+template <class Context>
+struct Emulators {
+    static constexpr EmulatorTable<Context> table = MakeEmulatorTable<Context>(MakeIndexList<256>::type());
+};
+
+template <class Context>
+constexpr EmulatorTable<Context> Emulators<Context>::table;
+
+// Fault corpus written by the DLL's capture mode (CAPTURE_FAULTS) and read
+// by fault_replay. Records are fixed size and appended back to back.
+constexpr uint32_t FAULT_RECORD_MAGIC = 0x54465257;  // "WRFT"
+constexpr int FAULT_CODE_BYTES = 16;
+
+static_assert(FAULT_CODE_BYTES >= MAX_INSTRUCTION_BYTES, "corpus must hold a whole instruction");
+
+// Integer, control and segment registers of a 32-bit CONTEXT. Field names
+// match CONTEXT so the emulators run on it directly during replay.
+struct FaultRegisters {
+    uint32_t Edi, Esi, Ebx, Edx, Ecx, Eax;
+    uint32_t Ebp, Eip, SegCs, EFlags, Esp, SegSs;
+    uint32_t SegGs, SegFs, SegEs, SegDs;
+};
+
+struct FaultRecord {
+    uint32_t magic;
+    uint32_t address;
+    uint8_t code[FAULT_CODE_BYTES];  // Bytes at the fault address
+    uint8_t codeLength;              // How many of them were readable
+    uint8_t handled;
+    uint8_t patch;                   // SitePatch
+    uint8_t patchLength;
+    uint8_t patchBytes[MAX_PATCH_BYTES];
+    FaultRegisters before;
+    FaultRegisters after;
+};
+
+static_assert(sizeof(FaultRecord) == 160, "fault corpus layout changed");
+
+template <class Context>
+FaultRegisters SaveRegisters(const Context& ctx) {
+    FaultRegisters regs = {
+        static_cast<uint32_t>(ctx.Edi), static_cast<uint32_t>(ctx.Esi),
+        static_cast<uint32_t>(ctx.Ebx), static_cast<uint32_t>(ctx.Edx),
+        static_cast<uint32_t>(ctx.Ecx), static_cast<uint32_t>(ctx.Eax),
+        static_cast<uint32_t>(ctx.Ebp), static_cast<uint32_t>(ctx.Eip),
+        static_cast<uint32_t>(ctx.SegCs), static_cast<uint32_t>(ctx.EFlags),
+        static_cast<uint32_t>(ctx.Esp), static_cast<uint32_t>(ctx.SegSs),
+        static_cast<uint32_t>(ctx.SegGs), static_cast<uint32_t>(ctx.SegFs),
+        static_cast<uint32_t>(ctx.SegEs), static_cast<uint32_t>(ctx.SegDs)
+    };
+    return regs;
+}
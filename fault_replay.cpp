@@ -0,0 +1,169 @@
+// Replays a fault corpus captured by a CAPTURE_FAULTS build of the DLL
+// through the same emulators, natively and without Windows headers.
+// Reports per-fault handler latency and any divergence from the capture,
+// and exits non-zero on a mismatch or a truncated corpus.
+//
+//   g++ -o fault_replay fault_replay.cpp -std=c++11 -Wall -O2
+//   ./fault_replay winerosetta2_faults.bin [iterations]
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "emulator.h"
+
+// Repetitions per fault when timing the handler
+constexpr int DEFAULT_ITERATIONS = 1000;
+
+// Mismatches printed in full before only counting
+constexpr int MAX_REPORTED_MISMATCHES = 20;
+
+// Keeps the optimizer from discarding timed calls
+volatile uint32_t g_sink;
+
+const char* const REGISTER_NAMES[] = {
+    "Edi", "Esi", "Ebx", "Edx", "Ecx", "Eax", "Ebp", "Eip",
+    "SegCs", "EFlags", "Esp", "SegSs", "SegGs", "SegFs", "SegEs", "SegDs"
+};
+
+// Load every complete record of a corpus file. A partial trailing record,
+// left when the game died mid-write, is reported and flagged in `truncated`.
+bool LoadCorpus(const char* path, std::vector<FaultRecord>& records, bool& truncated) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    FaultRecord record;
+    size_t got;
+    truncated = false;
+    while ((got = fread(&record, 1, sizeof(record), file)) == sizeof(record)) {
+        if (record.magic != FAULT_RECORD_MAGIC) {
+            fprintf(stderr, "Bad record %zu in %s\n", records.size(), path);
+            fclose(file);
+            return false;
+        }
+        records.push_back(record);
+    }
+
+    if (ferror(file)) {
+        fprintf(stderr, "Read error in %s after record %zu\n", path, records.size());
+        fclose(file);
+        return false;
+    }
+    if (got != 0) {
+        fprintf(stderr, "%s: trailing partial record (%zu of %zu bytes) after record %zu ignored\n",
+                path, got, sizeof(record), records.size());
+        truncated = true;
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Run one fault through its emulator
+EmulateResult Replay(const FaultRecord& record, FaultRegisters& regs) {
+    regs = record.before;
+    EmulateFn<FaultRegisters> emulate = Emulators<FaultRegisters>::table.entries[record.code[0]];
+    size_t length = record.codeLength < FAULT_CODE_BYTES ? record.codeLength : FAULT_CODE_BYTES;
+    return emulate && length > 0 ? emulate(&regs, record.code, length) : NOT_HANDLED;
+}
+
+// Compare a replay against what was captured, printing any differences
+bool CheckReplay(size_t index, const FaultRecord& record, const FaultRegisters& regs,
+                 const EmulateResult& result, bool report) {
+    bool match = true;
+
+    if (result.handled != (record.handled != 0) || result.patch != record.patch ||
+        (result.handled && (result.length != record.patchLength ||
+                            memcmp(result.bytes, record.patchBytes, sizeof(record.patchBytes)) != 0))) {
+        match = false;
+        if (report) {
+            printf("#%zu %08x: result handled=%d patch=%d length=%u, captured handled=%u patch=%u length=%u\n",
+                   index, record.address, result.handled, result.patch, result.length,
+                   record.handled, record.patch, record.patchLength);
+        }
+    }
+
+    const uint32_t* actual = reinterpret_cast<const uint32_t*>(&regs);
+    const uint32_t* expected = reinterpret_cast<const uint32_t*>(&record.after);
+    for (size_t i = 0; i < sizeof(FaultRegisters) / sizeof(uint32_t); i++) {
+        if (actual[i] != expected[i]) {
+            match = false;
+            if (report) {
+                printf("#%zu %08x: %s is %08x, captured %08x\n",
+                       index, record.address, REGISTER_NAMES[i], actual[i], expected[i]);
+            }
+        }
+    }
+
+    return match;
+}
+
+// Average handler latency for one fault, in nanoseconds
+double TimeReplay(const FaultRecord& record, int iterations) {
+    FaultRegisters regs;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        EmulateResult result = Replay(record, regs);
+        g_sink = regs.Eip + result.length;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <corpus> [iterations]\n", argv[0]);
+        return 2;
+    }
+
+    int iterations = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    std::vector<FaultRecord> records;
+    bool truncated;
+    if (!LoadCorpus(argv[1], records, truncated)) {
+        return 2;
+    }
+    if (records.empty()) {
+        printf("%s: no faults recorded\n", argv[1]);
+        return truncated ? 1 : 0;
+    }
+
+    size_t handled = 0;
+    size_t mismatches = 0;
+    std::vector<double> latencies;
+    latencies.reserve(records.size());
+
+    for (size_t i = 0; i < records.size(); i++) {
+        const FaultRecord& record = records[i];
+
+        FaultRegisters regs;
+        EmulateResult result = Replay(record, regs);
+        if (result.handled) {
+            handled++;
+        }
+        if (!CheckReplay(i, record, regs, result, mismatches < MAX_REPORTED_MISMATCHES)) {
+            mismatches++;
+        }
+
+        latencies.push_back(TimeReplay(record, iterations));
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t count = latencies.size();
+
+    printf("%zu faults, %zu handled, %zu mismatches\n", count, handled, mismatches);
+    printf("latency ns: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           latencies[count * 50 / 100], latencies[count * 90 / 100],
+           latencies[count * 99 / 100], latencies[count - 1]);
+
+    return (mismatches || truncated) ? 1 : 0;
+}
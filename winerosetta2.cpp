@@ -1,16 +1,11 @@
+// Keep <windows.h> from defining min/max macros that break <algorithm>
+#define NOMINMAX
 #include <windows.h>
 #include <cstdint>
 #include <tlhelp32.h>
+#include <algorithm>
 
-// Target problematic instructions
-constexpr uint16_t ARPL_OPCODE = 0xD063;
-constexpr uint16_t FCOMP_OPCODE = 0xD8DC;
-constexpr uint16_t FCOMP_ST0_OPCODE = 0xD8D8;
-constexpr uint16_t NOP_2BYTES = 0x9090;
-
-// For ZF flag
-constexpr DWORD ZF_FLAG = 0x40;
-constexpr DWORD RPL_MASK = 0x3;
+#include "emulator.h"
 
 // Global binary translator state
 struct {
@@ -21,7 +16,87 @@ struct {
     volatile LONG patchesApplied;
     volatile LONG arplFixed;
     volatile LONG fcompFixed;
-} g_state = {nullptr, 0, 0, 0};
+    
+    // Illegal instruction exceptions seen by the VEH
+    volatile LONG trapsSeen;
+    
+    // Sites patched by the VEH, excluding the upfront scan
+    volatile LONG runtimePatches;
+} g_state = {nullptr, 0, 0, 0, 0, 0};
+
+// Counter for a patched site
+volatile LONG* FixCounter(FixStat stat) {
+    switch (stat) {
+        case FIX_ARPL: return &g_state.arplFixed;
+        case FIX_FCOMP: return &g_state.fcompFixed;
+        default: return NULL;
+    }
+}
+
+// Write a handler's patch over the faulting site
+bool PatchSite(ULONG_PTR faultAddr, const EmulateResult& result) {
+    // A rewrite can only cover what fits in the replacement bytes
+    if (result.patch == PATCH_REWRITE && result.length > MAX_PATCH_BYTES) {
+        return false;
+    }
+    
+    DWORD oldProtect;
+    if (!VirtualProtect(reinterpret_cast<void*>(faultAddr), result.length, PAGE_EXECUTE_READWRITE, &oldProtect)) {
+        return false;
+    }
+    
+    uint8_t* site = reinterpret_cast<uint8_t*>(faultAddr);
+    for (uint8_t i = 0; i < result.length; i++) {
+        site[i] = result.patch == PATCH_STUB ? 0x90 : result.bytes[i];
+    }
+    
+    VirtualProtect(reinterpret_cast<void*>(faultAddr), result.length, oldProtect, &oldProtect);
+    
+    volatile LONG* counter = FixCounter(result.stat);
+    if (counter) {
+        InterlockedIncrement(counter);
+    }
+    InterlockedIncrement(&g_state.runtimePatches);
+    return true;
+}
+
+#ifdef CAPTURE_FAULTS
+// Fault capture: every trap is appended to a corpus for fault_replay
+HANDLE g_captureFile = INVALID_HANDLE_VALUE;
+
+void CaptureFault(ULONG_PTR faultAddr, SIZE_T length, const FaultRegisters& before, const CONTEXT* after,
+                  const EmulateResult& result) {
+    FaultRecord record = {};
+    record.magic = FAULT_RECORD_MAGIC;
+    record.address = static_cast<uint32_t>(faultAddr);
+    
+    // Only the bytes the handler was allowed to see
+    record.codeLength = static_cast<uint8_t>(length);
+    CopyMemory(record.code, reinterpret_cast<void*>(faultAddr), length);
+    
+    record.handled = result.handled;
+    record.patch = static_cast<uint8_t>(result.patch);
+    record.patchLength = result.length;
+    CopyMemory(record.patchBytes, result.bytes, sizeof(record.patchBytes));
+    record.before = before;
+    record.after = SaveRegisters(*after);
+    
+    // Appends of a single record are atomic, no lock needed
+    DWORD written;
+    WriteFile(g_captureFile, &record, sizeof(record), &written, NULL);
+}
+#endif
+
+// Readable bytes at a faulting instruction, up to the longest x86 encoding
+SIZE_T ReadableCodeLength(ULONG_PTR addr) {
+    SIZE_T length = MAX_INSTRUCTION_BYTES;
+    
+    // Only an instruction at the end of a readable region needs the shorter probes
+    while (length > 0 && IsBadReadPtr(reinterpret_cast<void*>(addr), length)) {
+        length--;
+    }
+    return length;
+}
 
 // Interrupt hook handler to intercept illegal instructions
 LONG WINAPI VectoredHandler(EXCEPTION_POINTERS* ExceptionInfo) {
@@ -30,61 +105,43 @@ LONG WINAPI VectoredHandler(EXCEPTION_POINTERS* ExceptionInfo) {
         return EXCEPTION_CONTINUE_SEARCH;
     }
     
+    InterlockedIncrement(&g_state.trapsSeen);
+    
     ULONG_PTR faultAddr = reinterpret_cast<ULONG_PTR>(ExceptionInfo->ExceptionRecord->ExceptionAddress);
     
-    // Check if it's a valid memory location
-    if (!IsBadReadPtr(reinterpret_cast<void*>(faultAddr), 2)) {
-        uint16_t opcode = *reinterpret_cast<uint16_t*>(faultAddr);
-        
-        // Handle ARPL
-        if (opcode == ARPL_OPCODE) {
-            // Call our ARPL emulation
-            auto dest = &ExceptionInfo->ContextRecord->Eax;
-            auto src = &ExceptionInfo->ContextRecord->Edx;
-            
-            uint16_t destVal = static_cast<uint16_t>(*dest);
-            uint16_t srcVal = static_cast<uint16_t>(*src);
-            
-            if ((destVal & RPL_MASK) < (srcVal & RPL_MASK)) {
-                // Set ZF
-                ExceptionInfo->ContextRecord->EFlags |= ZF_FLAG;
-                
-                // Update destination
-                destVal = (destVal & ~RPL_MASK) | (srcVal & RPL_MASK);
-                *dest = (*dest & 0xFFFF0000) | destVal;
-            } else {
-                // Clear ZF
-                ExceptionInfo->ContextRecord->EFlags &= ~ZF_FLAG;
-            }
-            
-            // Skip the instruction
-            ExceptionInfo->ContextRecord->Eip += 2;
-            
-            // Attempt to patch with NOPs for next time
-            DWORD oldProtect;
-            if (VirtualProtect(reinterpret_cast<void*>(faultAddr), 2, PAGE_EXECUTE_READWRITE, &oldProtect)) {
-                *reinterpret_cast<uint16_t*>(faultAddr) = NOP_2BYTES;
-                VirtualProtect(reinterpret_cast<void*>(faultAddr), 2, oldProtect, &oldProtect);
-                InterlockedIncrement(&g_state.arplFixed);
-            }
-            
-            return EXCEPTION_CONTINUE_EXECUTION;
-        }
-        
-        // Handle FCOMP
-        if (opcode == FCOMP_OPCODE) {
-            // Replace with FCOMP ST0
-            DWORD oldProtect;
-            if (VirtualProtect(reinterpret_cast<void*>(faultAddr), 2, PAGE_EXECUTE_READWRITE, &oldProtect)) {
-                *reinterpret_cast<uint16_t*>(faultAddr) = FCOMP_ST0_OPCODE;
-                VirtualProtect(reinterpret_cast<void*>(faultAddr), 2, oldProtect, &oldProtect);
-                InterlockedIncrement(&g_state.fcompFixed);
-                return EXCEPTION_CONTINUE_EXECUTION;
-            }
-        }
+    // Check if it's a valid memory location; handlers bound their decoding by `length`
+    SIZE_T length = ReadableCodeLength(faultAddr);
+    if (length == 0) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    
+    CONTEXT* ctx = ExceptionInfo->ContextRecord;
+    const uint8_t* code = reinterpret_cast<const uint8_t*>(faultAddr);
+    EmulateFn<CONTEXT> emulate = Emulators<CONTEXT>::table.entries[code[0]];
+    
+#ifdef CAPTURE_FAULTS
+    FaultRegisters before = SaveRegisters(*ctx);
+    EmulateResult result = emulate ? emulate(ctx, code, length) : NOT_HANDLED;
+    if (g_captureFile != INVALID_HANDLE_VALUE) {
+        CaptureFault(faultAddr, length, before, ctx, result);
+    }
+#else
+    if (!emulate) {
+        return EXCEPTION_CONTINUE_SEARCH;
     }
+    EmulateResult result = emulate(ctx, code, length);
+#endif
     
-    return EXCEPTION_CONTINUE_SEARCH;
+    if (!result.handled) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    
+    // Attempt to patch for next time; a rewrite is what makes the retry work
+    if (result.patch != PATCH_NONE && !PatchSite(faultAddr, result) && result.patch == PATCH_REWRITE) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    
+    return EXCEPTION_CONTINUE_EXECUTION;
 }
 
 // Optimize a memory block
@@ -167,6 +224,278 @@ DWORD WINAPI OptimizeThread(LPVOID param) {
     return 0;
 }
 
+#ifdef FRAME_STATS
+// Frame-time instrumentation
+//
+// wow.exe presents through either gdi32 SwapBuffers (OpenGL) or
+// IDirect3DDevice9::Present (D3D9). Both are reached via wow.exe's import
+// table, directly or through GetProcAddress, so that is where we hook. Each
+// presented frame stamps a ring buffer and a reporter thread periodically
+// turns the stamps into frame-time percentiles next to the trap and patch
+// counters for the same interval.
+constexpr LONG FRAME_RING_SIZE = 4096;  // Must be a power of two
+constexpr DWORD FRAME_REPORT_INTERVAL_MS = 5000;
+
+// COM vtable slots
+constexpr int D3D9_CREATEDEVICE_SLOT = 16;
+constexpr int D3D9DEVICE_PRESENT_SLOT = 17;
+
+typedef BOOL (WINAPI *SwapBuffersFn)(HDC);
+typedef void* (WINAPI *Direct3DCreate9Fn)(UINT);
+typedef HRESULT (WINAPI *CreateDeviceFn)(void*, UINT, DWORD, HWND, DWORD, void*, void**);
+typedef HRESULT (WINAPI *PresentFn)(void*, const RECT*, const RECT*, HWND, const void*);
+typedef FARPROC (WINAPI *GetProcAddressFn)(HMODULE, LPCSTR);
+
+// Frame stamps, written only by the presenting thread
+struct {
+    LARGE_INTEGER frequency;
+    volatile LONG running;
+    volatile LONG writeIndex;
+    LONGLONG stamps[FRAME_RING_SIZE];
+} g_frames = {};
+
+// Original entry points behind our hooks
+struct {
+    SwapBuffersFn swapBuffers;
+    SwapBuffersFn wglSwapBuffers;
+    Direct3DCreate9Fn direct3DCreate9;
+    CreateDeviceFn createDevice;
+    PresentFn present;
+    GetProcAddressFn getProcAddress;
+} g_hooks = {};
+
+// Stamp the end of a frame
+void RecordFrame() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    
+    // Single producer: fill the slot, then publish it
+    LONG index = g_frames.writeIndex;
+    g_frames.stamps[index & (FRAME_RING_SIZE - 1)] = now.QuadPart;
+    InterlockedExchange(&g_frames.writeIndex, index + 1);
+}
+
+BOOL WINAPI HookedSwapBuffers(HDC hdc) {
+    RecordFrame();
+    return g_hooks.swapBuffers(hdc);
+}
+
+BOOL WINAPI HookedWglSwapBuffers(HDC hdc) {
+    RecordFrame();
+    return g_hooks.wglSwapBuffers(hdc);
+}
+
+HRESULT WINAPI HookedPresent(void* device, const RECT* src, const RECT* dst, HWND window, const void* dirty) {
+    RecordFrame();
+    return g_hooks.present(device, src, dst, window, dirty);
+}
+
+// Swap a COM vtable slot. The previous entry is stored in `original`
+// before the swap so the hook can always call through it.
+bool HookVtableSlot(void* object, int slot, void* hook, void** original) {
+    void** entry = *reinterpret_cast<void***>(object) + slot;
+    if (*entry == hook) {
+        return false;
+    }
+    
+    DWORD oldProtect;
+    if (!VirtualProtect(entry, sizeof(void*), PAGE_EXECUTE_READWRITE, &oldProtect)) {
+        return false;
+    }
+    *original = *entry;
+    InterlockedExchangePointer(entry, hook);
+    VirtualProtect(entry, sizeof(void*), oldProtect, &oldProtect);
+    return true;
+}
+
+HRESULT WINAPI HookedCreateDevice(void* d3d, UINT adapter, DWORD deviceType, HWND window,
+                                  DWORD flags, void* presentParams, void** device) {
+    HRESULT hr = g_hooks.createDevice(d3d, adapter, deviceType, window, flags, presentParams, device);
+    if (SUCCEEDED(hr) && device && *device) {
+        // All devices share one vtable, so only the first hook sticks
+        HookVtableSlot(*device, D3D9DEVICE_PRESENT_SLOT, reinterpret_cast<void*>(HookedPresent),
+                       reinterpret_cast<void**>(&g_hooks.present));
+    }
+    return hr;
+}
+
+void* WINAPI HookedDirect3DCreate9(UINT sdkVersion) {
+    void* d3d = g_hooks.direct3DCreate9(sdkVersion);
+    if (d3d) {
+        HookVtableSlot(d3d, D3D9_CREATEDEVICE_SLOT, reinterpret_cast<void*>(HookedCreateDevice),
+                       reinterpret_cast<void**>(&g_hooks.createDevice));
+    }
+    return d3d;
+}
+
+// Redirect renderer entry points that wow.exe resolves at runtime
+FARPROC WINAPI HookedGetProcAddress(HMODULE module, LPCSTR name) {
+    FARPROC proc = g_hooks.getProcAddress(module, name);
+    
+    // Ignore ordinal lookups and misses
+    if (!proc || IS_INTRESOURCE(name)) {
+        return proc;
+    }
+    
+    if (lstrcmpA(name, "Direct3DCreate9") == 0) {
+        g_hooks.direct3DCreate9 = reinterpret_cast<Direct3DCreate9Fn>(proc);
+        return reinterpret_cast<FARPROC>(HookedDirect3DCreate9);
+    }
+    if (lstrcmpA(name, "wglSwapBuffers") == 0) {
+        g_hooks.wglSwapBuffers = reinterpret_cast<SwapBuffersFn>(proc);
+        return reinterpret_cast<FARPROC>(HookedWglSwapBuffers);
+    }
+    if (lstrcmpA(name, "SwapBuffers") == 0) {
+        g_hooks.swapBuffers = reinterpret_cast<SwapBuffersFn>(proc);
+        return reinterpret_cast<FARPROC>(HookedSwapBuffers);
+    }
+    
+    return proc;
+}
+
+// Replace a named import in a module's IAT. The previous target is stored
+// in `original` before the slot is swapped.
+bool HookImport(HMODULE module, const char* dllName, const char* funcName, void* hook, void** original) {
+    uint8_t* base = reinterpret_cast<uint8_t*>(module);
+    IMAGE_DOS_HEADER* dos = reinterpret_cast<IMAGE_DOS_HEADER*>(base);
+    IMAGE_NT_HEADERS* nt = reinterpret_cast<IMAGE_NT_HEADERS*>(base + dos->e_lfanew);
+    IMAGE_DATA_DIRECTORY& dir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+    if (!dir.VirtualAddress) {
+        return false;
+    }
+    
+    IMAGE_IMPORT_DESCRIPTOR* desc = reinterpret_cast<IMAGE_IMPORT_DESCRIPTOR*>(base + dir.VirtualAddress);
+    for (; desc->Name; desc++) {
+        if (lstrcmpiA(reinterpret_cast<char*>(base + desc->Name), dllName) != 0) {
+            continue;
+        }
+        
+        // Without a name table we can only match by resolved address
+        FARPROC target = NULL;
+        if (!desc->OriginalFirstThunk) {
+            HMODULE dll = GetModuleHandleA(dllName);
+            target = dll ? GetProcAddress(dll, funcName) : NULL;
+            if (!target) {
+                return false;
+            }
+        }
+        
+        IMAGE_THUNK_DATA* names = reinterpret_cast<IMAGE_THUNK_DATA*>(
+            base + (desc->OriginalFirstThunk ? desc->OriginalFirstThunk : desc->FirstThunk));
+        IMAGE_THUNK_DATA* slots = reinterpret_cast<IMAGE_THUNK_DATA*>(base + desc->FirstThunk);
+        for (; names->u1.AddressOfData; names++, slots++) {
+            if (target) {
+                if (slots->u1.Function != reinterpret_cast<ULONG_PTR>(target)) {
+                    continue;
+                }
+            } else {
+                if (IMAGE_SNAP_BY_ORDINAL(names->u1.Ordinal)) {
+                    continue;
+                }
+                IMAGE_IMPORT_BY_NAME* byName = reinterpret_cast<IMAGE_IMPORT_BY_NAME*>(base + names->u1.AddressOfData);
+                if (lstrcmpA(reinterpret_cast<char*>(byName->Name), funcName) != 0) {
+                    continue;
+                }
+            }
+            
+            DWORD oldProtect;
+            if (!VirtualProtect(&slots->u1.Function, sizeof(ULONG_PTR), PAGE_EXECUTE_READWRITE, &oldProtect)) {
+                return false;
+            }
+            *original = reinterpret_cast<void*>(slots->u1.Function);
+            InterlockedExchangePointer(reinterpret_cast<void**>(&slots->u1.Function), hook);
+            VirtualProtect(&slots->u1.Function, sizeof(ULONG_PTR), oldProtect, &oldProtect);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Periodically summarize frame times against trap and patch activity
+DWORD WINAPI FrameReportThread(LPVOID param) {
+    static LONGLONG frameTimes[FRAME_RING_SIZE];
+    
+    LONG readIndex = g_frames.writeIndex;
+    LONG lastTraps = g_state.trapsSeen;
+    LONG lastPatches = g_state.runtimePatches;
+    
+    while (g_frames.running) {
+        Sleep(FRAME_REPORT_INTERVAL_MS);
+        
+        LONG writeIndex = g_frames.writeIndex;
+        LONG traps = g_state.trapsSeen;
+        LONG patches = g_state.runtimePatches;
+        
+        // Frame i lasted stamps[i] - stamps[i - 1]. Stay well behind the
+        // producer so slots we read are not being overwritten.
+        LONG presented = writeIndex - readIndex;
+        LONG first = readIndex > 1 ? readIndex : 1;
+        if (writeIndex - first > FRAME_RING_SIZE / 2) {
+            first = writeIndex - FRAME_RING_SIZE / 2;
+        }
+        
+        int count = 0;
+        LONGLONG total = 0;
+        for (LONG i = first; i < writeIndex; i++) {
+            LONGLONG delta = g_frames.stamps[i & (FRAME_RING_SIZE - 1)] -
+                             g_frames.stamps[(i - 1) & (FRAME_RING_SIZE - 1)];
+            frameTimes[count++] = delta;
+            total += delta;
+        }
+        
+        char msg[256];
+        if (count > 0 && total > 0) {
+            std::sort(frameTimes, frameTimes + count);
+            
+            LONGLONG freq = g_frames.frequency.QuadPart;
+            DWORD p50 = static_cast<DWORD>(frameTimes[count * 50 / 100] * 1000000 / freq);
+            DWORD p90 = static_cast<DWORD>(frameTimes[count * 90 / 100] * 1000000 / freq);
+            DWORD p99 = static_cast<DWORD>(frameTimes[count * 99 / 100] * 1000000 / freq);
+            DWORD worst = static_cast<DWORD>(frameTimes[count - 1] * 1000000 / freq);
+            DWORD fps = static_cast<DWORD>(count * freq / total);
+            
+            wsprintfA(msg, "WineRosetta: %ld frames, last %d sampled: %lu fps, p50 %lu us, p90 %lu us, "
+                           "p99 %lu us, max %lu us, traps %ld, runtime patches %ld\n",
+                      presented, count, fps, p50, p90, p99, worst, traps - lastTraps, patches - lastPatches);
+        } else {
+            // No frame finished (loading screen or a long hitch), still
+            // account for the traps and patches behind the stall
+            wsprintfA(msg, "WineRosetta: %ld frames, traps %ld, runtime patches %ld\n",
+                      presented, traps - lastTraps, patches - lastPatches);
+        }
+        OutputDebugStringA(msg);
+        
+        readIndex = writeIndex;
+        lastTraps = traps;
+        lastPatches = patches;
+    }
+    
+    return 0;
+}
+
+// Hook the game's present path and start reporting
+void InitializeFrameStats() {
+    QueryPerformanceFrequency(&g_frames.frequency);
+    
+    HMODULE exe = GetModuleHandleA(NULL);
+    HookImport(exe, "gdi32.dll", "SwapBuffers", reinterpret_cast<void*>(HookedSwapBuffers),
+               reinterpret_cast<void**>(&g_hooks.swapBuffers));
+    HookImport(exe, "opengl32.dll", "wglSwapBuffers", reinterpret_cast<void*>(HookedWglSwapBuffers),
+               reinterpret_cast<void**>(&g_hooks.wglSwapBuffers));
+    HookImport(exe, "d3d9.dll", "Direct3DCreate9", reinterpret_cast<void*>(HookedDirect3DCreate9),
+               reinterpret_cast<void**>(&g_hooks.direct3DCreate9));
+    HookImport(exe, "kernel32.dll", "GetProcAddress", reinterpret_cast<void*>(HookedGetProcAddress),
+               reinterpret_cast<void**>(&g_hooks.getProcAddress));
+    
+    g_frames.running = 1;
+    HANDLE hThread = CreateThread(NULL, 0, FrameReportThread, NULL, 0, NULL);
+    if (hThread) {
+        CloseHandle(hThread);
+    }
+}
+#endif
+
 // Initialize our system
 void InitializeOptimizer() {
     // Start a thread to scan and optimize all code
@@ -178,7 +507,18 @@ void InitializeOptimizer() {
     }
     
     // Install VEH handler as a backup
+#ifdef CAPTURE_FAULTS
+    // Record traps for offline replay before the handler can see any
+    g_captureFile = CreateFileA("winerosetta2_faults.bin", FILE_APPEND_DATA, FILE_SHARE_READ, NULL,
+                                OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+    
     g_state.oldVehHandler = AddVectoredExceptionHandler(1, VectoredHandler);
+    
+#ifdef FRAME_STATS
+    // Optional frame-time reporting
+    InitializeFrameStats();
+#endif
 }
 
 // Clean up
@@ -187,6 +527,17 @@ void ShutdownOptimizer() {
         RemoveVectoredExceptionHandler(g_state.oldVehHandler);
         g_state.oldVehHandler = NULL;
     }
+    
+#ifdef FRAME_STATS
+    g_frames.running = 0;
+#endif
+    
+#ifdef CAPTURE_FAULTS
+    if (g_captureFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(g_captureFile);
+        g_captureFile = INVALID_HANDLE_VALUE;
+    }
+#endif
 }
 
 // DLL entry point